@@ -0,0 +1,169 @@
+/*
+** Copyright (C) Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** This firmware is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This firmware is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this firmware. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include <libopencm3/stm32/flash.h>
+#include <libopencm3/stm32/crc.h>
+#include <libopencm3/stm32/syscfg.h>
+
+#define APP 0x08000800 // Application start (see app.ld)
+#define PAGES 14 // Application size (KB)
+#define START_MAGIC 0x53544152 // 'STAR' (listen window passed)
+
+// Serial bootloader protocol (USART1 @ 500000 baud, 8N1, A2=TX, A3=RX):
+// 'C'                     -> N, CRC[N]     Query number of application pages and their CRC
+// 'W', n, DATA[1024], CRC -> 'K' | 'E'     Write page n (skipped if unchanged)
+// 'G'                                      Start application
+// 'B', 'O', 'O', 'T'                       Stay in bootloader (listen window)
+// CRC is computed by the hardware CRC unit over 32-bit words. Multi-byte values are little-endian.
+// After power-on or reset button, the bootloader listens for 100ms before starting the application,
+// so that a faulty application can still be replaced. The application is only started if its stack
+// pointer and reset vector are in range.
+// A command is dropped if the next byte doesn't arrive within 100ms, so that the host can resync.
+// The first page holding the vector table is erased before writing any other page, so that
+// an interrupted update never starts. Hence, it must be written last.
+
+static int buf[256];
+static int inv;
+
+static void start(const int *v) {
+	int *r = (int *)0x20000000;
+	for (int i = 0; i < 48; ++i) r[i] = v[i]; // Copy vector table to SRAM
+	RCC_APB2ENR = RCC_APB2ENR_SYSCFGCOMPEN;
+	SYSCFG_CFGR1 = SYSCFG_CFGR1_MEM_MODE_SRAM; // Map SRAM at 0x00000000
+	__asm__ volatile ("msr msp, %0\n\tbx %1" :: "r" (v[0]), "r" (v[1]));
+}
+
+static int recv(void) { // Returns -1 on timeout
+	STK_CVR = 0; // Restart timeout
+	while (!(USART1_ISR & USART_ISR_RXNE)) {
+		if (STK_CSR & STK_CSR_COUNTFLAG) return -1;
+	}
+	return USART1_RDR;
+}
+
+static int recvbuf(char *p, int n) {
+	for (int i = 0; i < n; ++i) {
+		int x = recv();
+		if (x < 0) return 0;
+		p[i] = x;
+	}
+	return 1;
+}
+
+static void send(int x) {
+	while (!(USART1_ISR & USART_ISR_TXE));
+	USART1_TDR = x;
+}
+
+static int crc(const int *p) {
+	CRC_CR = CRC_CR_RESET;
+	for (int i = 0; i < 256; ++i) CRC_DR = p[i];
+	return CRC_DR;
+}
+
+static void erase(int *p) {
+	int i;
+	for (i = 0; i < 256 && p[i] == -1; ++i);
+	if (i == 256) return; // Already blank
+	FLASH_CR = FLASH_CR_PER;
+	FLASH_AR = (int)p;
+	FLASH_CR = FLASH_CR_PER | FLASH_CR_STRT;
+	while (FLASH_SR & FLASH_SR_BSY);
+	FLASH_CR = 0;
+}
+
+static int write(int n) {
+	int *p = (int *)(APP + (n << 10));
+	int i;
+	if (n && !inv) { // Invalidate application
+		erase((int *)APP);
+		inv = 1;
+	}
+	for (i = 0; i < 256 && p[i] == buf[i]; ++i);
+	if (i == 256) return 'K'; // Unchanged
+	erase(p);
+	FLASH_CR = FLASH_CR_PG;
+	for (i = 0; i < 512; ++i) {
+		((volatile short *)p)[i] = ((short *)buf)[i];
+		while (FLASH_SR & FLASH_SR_BSY);
+	}
+	FLASH_CR = 0;
+	for (i = 0; i < 256 && p[i] == buf[i]; ++i);
+	return i == 256 ? 'K' : 'E';
+}
+
+void main(void) {
+	const int *v = (const int *)APP;
+	int f = BOOT_FLAG, app = (unsigned)v[0] - 0x20000000 <= 0x1000 && (unsigned)v[1] - APP < PAGES << 10; // Valid stack pointer and reset vector
+	unsigned csr = RCC_CSR & (RCC_CSR_PORRSTF | RCC_CSR_PINRSTF | RCC_CSR_SFTRSTF | RCC_CSR_IWDGRSTF | RCC_CSR_WWDGRSTF);
+	int listen = f != BOOT_MAGIC && ((csr & RCC_CSR_PORRSTF) || csr == RCC_CSR_PINRSTF); // Power-on or reset button (internal resets also pulse NRST)
+	BOOT_FLAG = 0;
+	if (app && (f == START_MAGIC || (f != BOOT_MAGIC && !listen))) start(v);
+
+	RCC_AHBENR = RCC_AHBENR_GPIOAEN | RCC_AHBENR_CRCEN;
+	RCC_APB2ENR = RCC_APB2ENR_USART1EN;
+
+	GPIOA_AFRL = 0x00001100; // A2 (USART1_TX), A3 (USART1_RX)
+	GPIOA_PUPDR = 0x24000040; // A3 (pull-up)
+	GPIOA_MODER = 0x280000a0; // A2 (USART1_TX), A3 (USART1_RX)
+
+	USART1_BRR = 16; // 500000 baud @ PCLK=8MHz
+	USART1_CR3 = USART_CR3_OVRDIS;
+	USART1_CR1 = USART_CR1_UE | USART_CR1_RE | USART_CR1_TE;
+
+	STK_RVR = 99999; // 100ms @ HCLK/8=1MHz
+	STK_CSR = STK_CSR_ENABLE;
+
+	if (app && listen) { // Listen window
+		STK_CVR = 0;
+		for (int w = 0; w != BOOT_MAGIC;) {
+			if (STK_CSR & STK_CSR_COUNTFLAG) { // Start application from clean reset state
+				BOOT_FLAG = START_MAGIC;
+				scb_reset_system();
+			}
+			if (USART1_ISR & USART_ISR_RXNE) w = w << 8 | USART1_RDR;
+		}
+	}
+
+	FLASH_KEYR = FLASH_KEYR_KEY1;
+	FLASH_KEYR = FLASH_KEYR_KEY2;
+
+	for (;;) {
+		switch (recv()) {
+			case 'C':
+				send(PAGES);
+				for (int i = 0; i < PAGES; ++i) {
+					int x = crc((int *)(APP + (i << 10)));
+					send(x);
+					send(x >> 8);
+					send(x >> 16);
+					send(x >> 24);
+				}
+				break;
+			case 'W': {
+				int n = recv(), x;
+				if (n < 0 || !recvbuf((char *)buf, 1024) || !recvbuf((char *)&x, 4)) break; // Timeout
+				send(n < PAGES && x == crc(buf) ? write(n) : 'E');
+				break;
+			}
+			case 'G':
+				scb_reset_system();
+				break;
+		}
+	}
+}
@@ -19,20 +19,39 @@
 #include <stdio.h>
 #include <errno.h>
 #include <libopencmsis/core_cm3.h>
+#include <libopencm3/cm3/systick.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/timer.h>
 #include <libopencm3/stm32/usart.h>
 #include <libopencm3/stm32/adc.h>
+#include <libopencm3/stm32/dma.h>
 #include <libopencm3/stm32/wwdg.h>
 
 // #define DEBUG // Debug mode
+#define MONITOR // Stack high-watermark and fault record (comment out to disable)
 
-extern int chv[14], sensors[3];
+#define BOOT_FLAG MMIO32(0x200000c0) // Preserved across reset (see boot.ld, app.ld)
+#define BOOT_MAGIC 0x424f4f54 // 'BOOT'
+
+#ifdef MONITOR
+#define MONITOR_SENSORS 0x810202, 0x820202 // Free stack (bytes), last fault
+#else
+#define MONITOR_SENSORS
+#endif
+
+extern int chv[14], sensors[7], peak, trips;
 
 void initserial(void);
 void initsensor(void);
+void initcurrent(int ch, int ht, int lt, int min);
 void update(void);
+void commit(int k);
+void trip(int k);
 int sensor(int i, int v);
 int senstype(int i);
 int sensval(int i);
+int foldback(int x);
+void initmonitor(void);
+int monitor(int c);
+void dumpmonitor(void);
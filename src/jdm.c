@@ -39,6 +39,13 @@
 #define FAN_OFF 250
 #define FAN_ON 300
 
+// #define CURRENT_CH 5 // Current sense channel (A5 instead of fan) (comment out to disable overcurrent protection)
+#define CURRENT_MAX 8000 // Trip threshold (mA)
+#define CURRENT_REARM 6000 // Re-arm threshold (mA)
+#define CURRENT_FS 33000 // Full scale (mA)
+#define CURRENT_RAMP 2 // Recovery rate (1/256 per update)
+#define CURRENT_FOLD 64 // Minimum output (1/256)
+
 static int input1(int t, int *u, int x) {
 	*u = t + x;
 	t = t < 1500 ? 1500 - t : t - 1500;
@@ -76,6 +83,10 @@ static int output3(int t) {
 	return 1500 + t;
 }
 
+static int scale(int t, int k) {
+	return 1500 + ((t - 1500) * k >> 8);
+}
+
 static int ramp(int t, int u, int x) {
 	if (!u || !x) return t;
 	if (t < 1500) {
@@ -94,7 +105,60 @@ static int u1, u2, u3, u4, u5, u6, u7, u8;
 static int i1, i2, i3, i4, i5;
 static int s1, s2, s3;
 
+// Outputs are staged in a shadow block and committed together right after the TIM1 update event:
+// TIM1_CCR1-4 and TIM3_CCR1-4 by burst DMA, TIM14_CCR1 (no DMA) by the update interrupt.
+// TIM3 is started by TIM1 and TIM14 is started along with TIM1, so all periods begin at once.
+// Preload is off, so new values take effect in the period that has just begun. Staging waits
+// until the counter is clear of the update event, so that a commit is never torn or dropped.
+// Only the last frame staged in a TIM1 period (8ms) is output, i.e. some frames (7ms) are superseded.
+static volatile short out[9]; // TIM1_CCR1-4, TIM3_CCR1-4, TIM14_CCR1
+
+void commit(int k) {
+	int c;
+	while ((c = TIM1_CNT) < 20 || c > 7950); // Stay clear of update event
+	out[0] = u7;
+	out[1] = scale(u5, k);
+	out[2] = scale(u6, k);
+	out[3] = u8;
+	out[4] = u1;
+	out[5] = u2;
+	out[7] = u3;
+	out[8] = scale(u4, k);
+}
+
+// On overcurrent, the pump and tracks are cut down at once rather than at the next update event.
+// A lower CCR in PWM mode 1 at most shortens the current pulse. Track reverse is scaled up towards
+// 1500 though, and a higher CCR would restart a pulse that has already ended, unless the counter
+// is past the new value too. Such a track is left to the burst at the next update event.
+void trip(int k) {
+	int x2 = scale(u5, k), x3 = scale(u6, k), c = TIM1_CNT;
+	TIM14_CCR1 = scale(u4, k); // Pump is never scaled up
+	if (x2 <= (int)TIM1_CCR2 || c >= x2) TIM1_CCR2 = x2;
+	if (x3 <= (int)TIM1_CCR3 || c >= x3) TIM1_CCR3 = x3;
+	commit(k);
+}
+
+#ifdef DEBUG
+static int boot0, boot1; // Time to PLL lock and to first update since main() (us)
+static volatile int wraps; // SysTick wraps (changed by preempting interrupt)
+
+void sys_tick_handler(void) {
+	++wraps;
+}
+#endif
+
 void update(void) {
+#ifdef DEBUG
+	if (!boot1) {
+		int w, c;
+		do {
+			w = wraps;
+			c = STK_CVR;
+		} while (w != wraps);
+		boot1 = boot0 + w * 2796203 + (0xffffff - c) / 6; // 2^24/6MHz per wrap
+		STK_CSR = STK_CSR_ENABLE;
+	}
+#endif
 	s1 = input3(chv[5]);
 	s2 = input3(chv[6]);
 	s3 = input3(chv[7]);
@@ -112,14 +176,11 @@ void update(void) {
 	u7 = s2 ? 2000 : s3 ? 1000 : 1500;
 	u8 = output3(i1 + i2 + abs(i3) + abs(i4) + i5);
 
-	TIM3_CCR1 = u1;
-	TIM3_CCR2 = u2;
-	TIM3_CCR4 = u3;
-	TIM14_CCR1 = u4;
-	TIM1_CCR2 = u5;
-	TIM1_CCR3 = u6;
-	TIM1_CCR1 = u7;
-	TIM1_CCR4 = u8;
+#ifdef CURRENT_CH
+	commit(foldback(CURRENT_RAMP));
+#else
+	commit(256);
+#endif
 
 	GPIOA_BSRR = s1 ? 0x4000 : 0x40000000; // A14
 	GPIOA_BSRR = sl ? 0x20000000 : 0x2000; // A13
@@ -133,7 +194,11 @@ void update(void) {
 #endif
 }
 
-int sensors[3] = {0x000201, 0x010203};
+#ifdef CURRENT_CH
+int sensors[7] = {0x000201, 0x010203, 0x800205, 0x800202, MONITOR_SENSORS};
+#else
+int sensors[7] = {0x000201, 0x010203, MONITOR_SENSORS};
+#endif
 
 int sensor(int i, int v) {
 	switch (i) {
@@ -144,12 +209,19 @@ int sensor(int i, int v) {
 		}
 		case 1: // Voltage divider
 			return (v * VOLT2) >> 12;
+#ifdef CURRENT_CH
+		case 2: // Peak current
+			return peak * CURRENT_FS / 40960;
+		case 3: // Overcurrent trips
+			return trips;
+#endif
 	}
 	return 0;
 }
 
 void tim1_brk_up_trg_com_isr(void) {
 	TIM1_SR = ~TIM_SR_UIF;
+	TIM14_CCR1 = out[8];
 	int br = 0;
 	if (TIM1_CCR1) br |= 0x1; // F0 high
 	if (TIM1_CCR4) br |= 0x2; // F1 high
@@ -171,9 +243,11 @@ void tim1_cc_isr(void) {
 }
 
 void main(void) {
-	rcc_clock_setup_in_hsi_out_48mhz(); // PCLK=48MHz
-
-	RCC_AHBENR = RCC_AHBENR_GPIOAEN | RCC_AHBENR_GPIOBEN | RCC_AHBENR_GPIOFEN;
+#ifdef DEBUG
+	STK_RVR = 0xffffff;
+	STK_CSR = STK_CSR_ENABLE; // 1MHz @ HCLK=8MHz
+#endif
+	RCC_AHBENR = RCC_AHBENR_DMAEN | RCC_AHBENR_GPIOAEN | RCC_AHBENR_GPIOBEN | RCC_AHBENR_GPIOFEN;
 	RCC_APB2ENR = RCC_APB2ENR_SYSCFGCOMPEN | RCC_APB2ENR_ADCEN | RCC_APB2ENR_TIM1EN | RCC_APB2ENR_USART1EN | RCC_APB2ENR_TIM16EN;
 	RCC_APB1ENR = RCC_APB1ENR_TIM3EN | RCC_APB1ENR_TIM14EN | RCC_APB1ENR_WWDGEN;
 
@@ -186,8 +260,25 @@ void main(void) {
 	GPIOA_MODER = 0x5569a6af; // A0,A1 (analog), A2 (USART1_TX), A3 (USART1_RX), A4 (TIM14_CH1), A6 (TIM3_CH1), A7 (TIM3_CH2), A9 (TIM1_CH2), A10 (TIM1_CH3)
 	GPIOB_MODER = 0x55555559; // B1 (TIM3_CH4)
 	GPIOF_MODER = 0x55555555;
+#ifdef CURRENT_CH
+	GPIOA_MODER |= 3 << (CURRENT_CH << 1); // Analog
+	initcurrent(CURRENT_CH, CURRENT_MAX * 4096 / CURRENT_FS, CURRENT_REARM * 4096 / CURRENT_FS, CURRENT_FOLD);
+#endif
+	initsensor();
+
+	rcc_clock_setup_in_hsi_out_48mhz(); // PCLK=48MHz
+#ifdef DEBUG
+	boot0 = 0xffffff - STK_CVR;
+	STK_CVR = 0; // 6MHz @ HCLK=48MHz
+	STK_CSR = STK_CSR_ENABLE | STK_CSR_TICKINT; // Count wraps (every ~2.8s) until first update
+#endif
 
 	WWDG_CFR = 0x1ff; // Watchdog timeout 4096*8*64/PCLK=~43ms
+#ifdef MONITOR
+	initmonitor();
+#endif
+
+	initserial(); // Outputs are safe at this point, so receive servo data as soon as possible
 
 	nvic_enable_irq(NVIC_TIM1_BRK_UP_TRG_COM_IRQ);
 	nvic_enable_irq(NVIC_TIM1_CC_IRQ);
@@ -195,38 +286,58 @@ void main(void) {
 	TIM1_PSC = 47; // 1MHz
 	TIM1_ARR = 7999; // 125Hz
 	TIM1_EGR = TIM_EGR_UG;
-	TIM1_CR1 = TIM_CR1_CEN;
+	TIM1_CR2 = TIM_CR2_MMS_UPDATE; // TRGO on update event
+	TIM1_DCR = 0x30d; // Burst of 4 transfers from CCR1
 	TIM1_BDTR = TIM_BDTR_MOE;
-	TIM1_CCMR1 = TIM_CCMR1_OC1PE | TIM_CCMR1_OC2PE | TIM_CCMR1_OC2M_PWM1;
-	TIM1_CCMR2 = TIM_CCMR2_OC3PE | TIM_CCMR2_OC4PE | TIM_CCMR2_OC3M_PWM1;
+	TIM1_CCMR1 = TIM_CCMR1_OC2M_PWM1;
+	TIM1_CCMR2 = TIM_CCMR2_OC3M_PWM1;
 	TIM1_CCER = TIM_CCER_CC2E | TIM_CCER_CC3E;
-	TIM1_DIER = TIM_DIER_UIE | TIM_DIER_CC1IE | TIM_DIER_CC4IE;
+	TIM1_DIER = TIM_DIER_UIE | TIM_DIER_CC1IE | TIM_DIER_CC4IE | TIM_DIER_UDE;
 
 	TIM3_PSC = 47; // 1MHz
 	TIM3_ARR = 3999; // 250Hz
 	TIM3_EGR = TIM_EGR_UG;
-	TIM3_CR1 = TIM_CR1_CEN;
-	TIM3_CCMR1 = TIM_CCMR1_OC1PE | TIM_CCMR1_OC1M_PWM1 | TIM_CCMR1_OC2PE | TIM_CCMR1_OC2M_PWM1;
-	TIM3_CCMR2 = TIM_CCMR2_OC4PE | TIM_CCMR2_OC4M_PWM1;
+	TIM3_SMCR = TIM_SMCR_SMS_TM | TIM_SMCR_TS_ITR0; // Start on TIM1 update event
+	TIM3_DCR = 0x30d; // Burst of 4 transfers from CCR1
+	TIM3_CCMR1 = TIM_CCMR1_OC1M_PWM1 | TIM_CCMR1_OC2M_PWM1;
+	TIM3_CCMR2 = TIM_CCMR2_OC4M_PWM1;
 	TIM3_CCER = TIM_CCER_CC1E | TIM_CCER_CC2E | TIM_CCER_CC4E;
+	TIM3_DIER = TIM_DIER_TDE; // DMA request on each trigger
 
 	TIM14_PSC = 47; // 1MHz
 	TIM14_ARR = 3999; // 250Hz
 	TIM14_EGR = TIM_EGR_UG;
-	TIM14_CR1 = TIM_CR1_CEN;
-	TIM14_CCMR1 = TIM_CCMR1_OC1PE | TIM_CCMR1_OC1M_PWM1;
+	TIM14_CCMR1 = TIM_CCMR1_OC1M_PWM1;
 	TIM14_CCER = TIM_CCER_CC1E;
 
-	initsensor();
-	initserial();
+	DMA1_CPAR5 = (int)&TIM1_DMAR; // TIM1_UP
+	DMA1_CMAR5 = (int)out;
+	DMA1_CNDTR5 = 4;
+	DMA1_CCR5 = DMA_CCR_EN | DMA_CCR_CIRC | DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_MSIZE_16BIT | DMA_CCR_PSIZE_16BIT;
+
+	DMA1_CPAR4 = (int)&TIM3_DMAR; // TIM3_TRIG
+	DMA1_CMAR4 = (int)(out + 4);
+	DMA1_CNDTR4 = 4;
+	DMA1_CCR4 = DMA_CCR_EN | DMA_CCR_CIRC | DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_MSIZE_16BIT | DMA_CCR_PSIZE_16BIT;
+
+	TIM14_CR1 = TIM_CR1_CEN;
+	TIM1_CR1 = TIM_CR1_CEN;
+
 #ifdef DEBUG
 	printf("\n");
+#ifdef MONITOR
+	dumpmonitor(); // Before last reset
+#endif
 	printf("  U1   U2   U3   U4   U5   U6   U7   U8      I1   I2   I3   I4   I5    SW\n");
 #endif
 	for (;;) {
 		SCB_SCR = SCB_SCR_SLEEPONEXIT; // Suspend main loop
 		__WFI();
 #ifdef DEBUG
+		if (boot1 > 0) {
+			printf("Boot: %dus since main() (PLL: %dus)\n", boot1, boot0);
+			boot1 = -1;
+		}
 		printf("%4d %4d %4d %4d %4d %4d %4d %4d    %4d %4d %4d %4d %4d    %d %d %d\n",
 			u1, u2, u3, u4, u5, u6, u7, u8, i1, i2, i3, i4, i5, s1, s2, s3);
 #endif
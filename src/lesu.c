@@ -28,12 +28,30 @@
 #define DRIVE_MAX 500 // Maximum duty
 #define DRIVE_LIM 20 // Acceleration limit
 #define DRIVE_PWM 4 // PWM frequency divider F_PWM=96000/(DRIVE_PWM+1) (comment out for servo PWM)
+// #define DRIVE_BRIDGE 10 // H-bridge gate drive with dead time DT=DRIVE_BRIDGE*(DRIVE_PWM+1)/48us, max 127/48us (comment out for PWM/DIR driver)
+// #define DRIVE_SYNC // Synchronous rectification (DRIVE_BRIDGE)
 
 #define BUZZER_FREQ 1318 // Frequency (Hz) (comment out for active buzzer)
 
+// #define CURRENT_CH 6 // Current sense channel (A6 instead of left blinker) (comment out to disable overcurrent protection)
+#define CURRENT_MAX 8000 // Trip threshold (mA)
+#define CURRENT_REARM 6000 // Re-arm threshold (mA)
+#define CURRENT_FS 33000 // Full scale (mA)
+#define CURRENT_RAMP 2 // Recovery rate (1/256 per update)
+#define CURRENT_FOLD 64 // Minimum output (1/256)
+
 #define VOLT1 3336 // mV
 #define VOLT2 3720 // xx.xxV = VOLT1*(R1+R2)/R2
 
+#ifdef DRIVE_BRIDGE
+#ifndef DRIVE_PWM
+#error DRIVE_BRIDGE requires DRIVE_PWM
+#endif
+#if DRIVE_BRIDGE * (DRIVE_PWM + 1) > 127
+#error Dead time DRIVE_BRIDGE*(DRIVE_PWM+1) exceeds 127 (TIM1_BDTR_DTG linear range)
+#endif
+#endif
+
 static int input1(int t) {
 	t = t < 1500 ? 1500 - t : t - 1500;
 	return t < VALVE_MIN ? 0 : VALVE_MUL * (t - VALVE_MIN) / 200;
@@ -62,7 +80,7 @@ static int output2(int t) {
 	return 1500 + t;
 }
 
-#ifdef DRIVE_PWM
+#if defined DRIVE_PWM && !defined DRIVE_BRIDGE
 static int output3(int t, int *f, int *r) {
 	if (t < 1500 - DRIVE_MIN) {
 		*f = 0;
@@ -80,6 +98,18 @@ static int output3(int t, int *f, int *r) {
 }
 #endif
 
+#ifdef DRIVE_BRIDGE
+static int dir(int t, int d) {
+	int x = t < 1500 - DRIVE_MIN ? -1 : t > 1500 + DRIVE_MIN;
+	if (x && d && x != d) return 0; // Pass through off state on reversal
+	return x;
+}
+#endif
+
+static int scale(int t, int k) {
+	return 1500 + ((t - 1500) * k >> 8);
+}
+
 static int ramp(int t, int u, int x) {
 	if (!u || !x) return t;
 	if (t < 1500) {
@@ -98,7 +128,138 @@ static int u1, u2, u3;
 static int i1, i2, i3, i4, i5;
 static int s1, s2;
 
+#ifdef DRIVE_BRIDGE
+static int d1, d2, br1, br2;
+
+static int output4(int t, int d) {
+	return (t = (t - 1500) * d) > 0 ? t >> 1 : 0; // Center-aligned PWM
+}
+
+// Leg A of each bridge is switched by TIM1, leg B is set by GPIO. Duty, output modes (CCPC=1) and GPIO
+// are committed together at the update event that occurs on counter overflow, i.e. in the middle of
+// the inactive phase. CH2 and CH1N of the left bridge belong to different channels, so their dead time
+// is made by shifting CCR1 against CCR2. Direction is only changed by update() once the previous state
+// has been committed, so that foldback scales duty without ever skipping the off state on reversal.
+static void bridge(int t1, int t2) {
+	TIM1_CR1 = TIM_CR1_CMS_CENTER_1 | TIM_CR1_CEN | TIM_CR1_UDIS; // Disable update event while staging
+	int x1 = output4(t1, d1), x2 = output4(t2, d2);
+	int ccmr1 = TIM_CCMR1_OC1PE | TIM_CCMR1_OC2PE;
+	int ccmr2 = TIM_CCMR2_OC3PE;
+	int ccer = TIM_CCER_CC1E | TIM_CCER_CC2E | TIM_CCER_CC3E;
+	int bra, brf;
+	switch (d1) {
+		case 1: // Leg A high side switching, leg B low side on
+			TIM1_CCR1 = x1 + DRIVE_BRIDGE;
+			TIM1_CCR2 = x1;
+			ccmr1 |= TIM_CCMR1_OC1M_PWM1 | TIM_CCMR1_OC2M_PWM1;
+#ifdef DRIVE_SYNC
+			ccer |= TIM_CCER_CC1NE;
+#endif
+			bra = 0x00200002; // A1 high, A5 low
+			break;
+		case -1: // Leg A low side switching, leg B high side on
+			TIM1_CCR1 = x1;
+			TIM1_CCR2 = x1 + DRIVE_BRIDGE;
+#ifdef DRIVE_SYNC
+			ccmr1 |= TIM_CCMR1_OC1M_PWM2 | TIM_CCMR1_OC2M_PWM2;
+#else
+			ccmr1 |= TIM_CCMR1_OC1M_PWM2 | TIM_CCMR1_OC2M_FORCE_LOW;
+#endif
+			ccer |= TIM_CCER_CC1NE;
+			bra = 0x00020020; // A1 low, A5 high
+			break;
+		default: // All off
+			TIM1_CCR1 = 0; // Never leave other direction in preload
+			TIM1_CCR2 = 0;
+			ccmr1 |= TIM_CCMR1_OC1M_FORCE_LOW | TIM_CCMR1_OC2M_FORCE_LOW;
+			bra = 0x00220000;
+			break;
+	}
+	switch (d2) {
+		case 1:
+			ccmr2 |= TIM_CCMR2_OC3M_PWM1;
+#ifdef DRIVE_SYNC
+			ccer |= TIM_CCER_CC3NE;
+#endif
+			brf = 0x00020001; // F0 high, F1 low
+			break;
+		case -1:
+#ifdef DRIVE_SYNC
+			ccmr2 |= TIM_CCMR2_OC3M_PWM2;
+#else
+			ccmr2 |= TIM_CCMR2_OC3M_PWM1; // CH3N follows OC3REF (not complemented) when CH3 is off (OSSR=1)
+			ccer &= ~TIM_CCER_CC3E;
+#endif
+			ccer |= TIM_CCER_CC3NE;
+			brf = 0x00010002; // F0 low, F1 high
+			break;
+		default:
+			ccmr2 |= TIM_CCMR2_OC3M_FORCE_LOW;
+			brf = 0x00030000;
+			break;
+	}
+	TIM1_CCR3 = x2;
+	TIM1_CCMR1 = ccmr1;
+	TIM1_CCMR2 = ccmr2;
+	TIM1_CCER = ccer;
+	br1 = bra;
+	br2 = brf;
+	TIM1_SR = ~TIM_SR_UIF; // Drop update events latched since last commit
+	TIM1_DIER = TIM_DIER_UIE;
+	TIM1_CR1 = TIM_CR1_CMS_CENTER_1 | TIM_CR1_CEN; // Enable update event
+}
+
+void tim1_brk_up_trg_com_isr(void) {
+	TIM1_SR = ~TIM_SR_UIF;
+	TIM1_DIER = 0;
+	TIM1_EGR = TIM_EGR_COMG; // Commit output modes
+	GPIOA_BSRR = br1; // A1,A5
+	GPIOF_BSRR = br2; // F0,F1
+}
+#endif
+
+void commit(int k) {
+	int t1 = scale(u1, k), t2 = scale(u2, k);
+#ifdef DRIVE_BRIDGE
+	bridge(t1, t2);
+#elif defined DRIVE_PWM
+	int f1, r1, f2, r2;
+	TIM1_CCR2 = output3(t1, &f1, &r1);
+	TIM1_CCR3 = output3(t2, &f2, &r2);
+	GPIOA_BSRR = (f1 ? 0x02 : 0x20000) | (r1 ? 0x20 : 0x200000); // A1,A5
+	GPIOF_BSRR = (f2 ? 0x01 : 0x10000) | (r2 ? 0x02 : 0x020000); // F0,F1
+#else
+	TIM1_CCR2 = t1;
+	TIM1_CCR3 = t2;
+#endif
+	TIM14_CCR1 = scale(u3, k);
+}
+
+void trip(int k) {
+	commit(k);
+}
+
+#ifdef DEBUG
+static int boot0, boot1; // Time to PLL lock and to first update since main() (us)
+static volatile int wraps; // SysTick wraps (changed by preempting interrupt)
+
+void sys_tick_handler(void) {
+	++wraps;
+}
+#endif
+
 void update(void) {
+#ifdef DEBUG
+	if (!boot1) {
+		int w, c;
+		do {
+			w = wraps;
+			c = STK_CVR;
+		} while (w != wraps);
+		boot1 = boot0 + w * 2796203 + (0xffffff - c) / 6; // 2^24/6MHz per wrap
+		STK_CSR = STK_CSR_ENABLE;
+	}
+#endif
 	s1 = input3(chv[5]);
 	s2 = input3(chv[6]);
 
@@ -111,18 +272,18 @@ void update(void) {
 	u1 = ramp(output2(i3 + i4), u1, DRIVE_LIM);
 	u2 = ramp(output2(i3 - i4), u2, DRIVE_LIM);
 	u3 = ramp(output1(i1 + i2 + i5), u3, PUMP_LIM);
+#ifdef DRIVE_BRIDGE
+	if (!(TIM1_DIER & TIM_DIER_UIE)) { // Previous state committed
+		d1 = dir(u1, d1);
+		d2 = dir(u2, d2);
+	}
+#endif
 
-#ifdef DRIVE_PWM
-	int f1, r1, f2, r2;
-	TIM1_CCR2 = output3(u1, &f1, &r1);
-	TIM1_CCR3 = output3(u2, &f2, &r2);
-	GPIOA_BSRR = (f1 ? 0x02 : 0x20000) | (r1 ? 0x20 : 0x200000); // A1,A5
-	GPIOF_BSRR = (f2 ? 0x01 : 0x10000) | (r2 ? 0x02 : 0x020000); // F0,F1
+#ifdef CURRENT_CH
+	commit(foldback(CURRENT_RAMP));
 #else
-	TIM1_CCR2 = u1;
-	TIM1_CCR3 = u2;
+	commit(256);
 #endif
-	TIM14_CCR1 = u3;
 
 	static int bm;
 	int b = bm;
@@ -156,7 +317,11 @@ void update(void) {
 #endif
 }
 
-int sensors[3] = {0x100201, 0x000203};
+#ifdef CURRENT_CH
+int sensors[7] = {0x100201, 0x000203, 0x800205, 0x800202, MONITOR_SENSORS};
+#else
+int sensors[7] = {0x100201, 0x000203, MONITOR_SENSORS};
+#endif
 
 int sensor(int i, int v) {
 	switch (i) {
@@ -164,6 +329,12 @@ int sensor(int i, int v) {
 			return (v * VOLT1 / 3300 - ST_TSENSE_CAL1_30C) * 800 / (ST_TSENSE_CAL2_110C - ST_TSENSE_CAL1_30C) + 700;
 		case 1: // Voltage divider
 			return (v * VOLT2) >> 12;
+#ifdef CURRENT_CH
+		case 2: // Peak current
+			return peak * CURRENT_FS / 40960;
+		case 3: // Overcurrent trips
+			return trips;
+#endif
 	}
 	return 0;
 }
@@ -185,13 +356,24 @@ beep:
 }
 
 void main(void) {
-	rcc_clock_setup_in_hsi_out_48mhz(); // PCLK=48MHz
-
+#ifdef DEBUG
+	STK_RVR = 0xffffff;
+	STK_CSR = STK_CSR_ENABLE; // 1MHz @ HCLK=8MHz
+#endif
 	RCC_AHBENR = RCC_AHBENR_GPIOAEN | RCC_AHBENR_GPIOBEN | RCC_AHBENR_GPIOFEN;
 	RCC_APB2ENR = RCC_APB2ENR_SYSCFGCOMPEN | RCC_APB2ENR_ADCEN | RCC_APB2ENR_TIM1EN | RCC_APB2ENR_USART1EN | RCC_APB2ENR_TIM16EN | RCC_APB2ENR_TIM17EN;
 	RCC_APB1ENR = RCC_APB1ENR_TIM3EN | RCC_APB1ENR_TIM14EN | RCC_APB1ENR_WWDGEN;
 
 	// Default GPIO state - output low
+#ifdef DRIVE_BRIDGE
+	GPIOA_AFRL = 0x21041100; // A2 (USART1_TX), A3 (USART1_RX), A4 (TIM14_CH1), A6 (TIM3_CH1), A7 (TIM1_CH1N)
+	GPIOA_AFRH = 0x00000220; // A9 (TIM1_CH2), A10 (TIM1_CH3)
+	GPIOB_AFRL = 0x00000020; // B1 (TIM1_CH3N)
+	GPIOA_ODR = 0x2000; // A13 (high)
+	GPIOA_PUPDR = 0x00000050; // A2,A3 (pull-up)
+	GPIOA_MODER = 0x5569a6a7; // A0 (analog), A2 (USART1_TX), A3 (USART1_RX), A4 (TIM14_CH1), A6 (TIM3_CH1), A7 (TIM1_CH1N), A9 (TIM1_CH2), A10 (TIM1_CH3)
+	GPIOB_MODER = 0x55555559; // B1 (TIM1_CH3N)
+#else
 	GPIOA_AFRL = 0x51041100; // A2 (USART1_TX), A3 (USART1_RX), A4 (TIM14_CH1), A6 (TIM3_CH1), A7 (TIM17_CH1)
 	GPIOA_AFRH = 0x00000220; // A9 (TIM1_CH2), A10 (TIM1_CH3)
 	GPIOB_AFRL = 0x00000010; // B1 (TIM3_CH4)
@@ -199,12 +381,45 @@ void main(void) {
 	GPIOA_PUPDR = 0x00000050; // A2,A3 (pull-up)
 	GPIOA_MODER = 0x5569a6a7; // A0 (analog), A2 (USART1_TX), A3 (USART1_RX), A4 (TIM14_CH1), A6 (TIM3_CH1), A7 (TIM17_CH1), A9 (TIM1_CH2), A10 (TIM1_CH3)
 	GPIOB_MODER = 0x55555559; // B1 (TIM3_CH4)
+#endif
 	GPIOF_MODER = 0x55555555;
+#ifdef CURRENT_CH
+	GPIOA_MODER |= 3 << (CURRENT_CH << 1); // Analog
+	initcurrent(CURRENT_CH, CURRENT_MAX * 4096 / CURRENT_FS, CURRENT_REARM * 4096 / CURRENT_FS, CURRENT_FOLD);
+#endif
+	initsensor();
+
+	rcc_clock_setup_in_hsi_out_48mhz(); // PCLK=48MHz
+#ifdef DEBUG
+	boot0 = 0xffffff - STK_CVR;
+	STK_CVR = 0; // 6MHz @ HCLK=48MHz
+	STK_CSR = STK_CSR_ENABLE | STK_CSR_TICKINT; // Count wraps (every ~2.8s) until first update
+#endif
 
 	WWDG_CFR = 0x1ff; // Watchdog timeout 4096*8*64/PCLK=~43ms
+#ifdef MONITOR
+	initmonitor();
+#endif
+
+	initserial(); // Outputs are safe at this point, so receive servo data as soon as possible
 
 	nvic_enable_irq(NVIC_TIM3_IRQ);
 
+#ifdef DRIVE_BRIDGE
+	nvic_enable_irq(NVIC_TIM1_BRK_UP_TRG_COM_IRQ);
+
+	TIM1_PSC = DRIVE_PWM;
+	TIM1_ARR = 250; // Center-aligned
+	TIM1_RCR = 1; // Update event on overflow only
+	TIM1_EGR = TIM_EGR_UG;
+	TIM1_CR1 = TIM_CR1_CMS_CENTER_1 | TIM_CR1_CEN;
+	TIM1_CR2 = TIM_CR2_CCPC; // Preload CCxE, CCxNE, OCxM
+	TIM1_BDTR = TIM_BDTR_MOE | TIM_BDTR_OSSR | DRIVE_BRIDGE * (DRIVE_PWM + 1); // Dead time (DTG=0..127, 1/48us)
+	TIM1_CCMR1 = TIM_CCMR1_OC1PE | TIM_CCMR1_OC1M_FORCE_LOW | TIM_CCMR1_OC2PE | TIM_CCMR1_OC2M_FORCE_LOW;
+	TIM1_CCMR2 = TIM_CCMR2_OC3PE | TIM_CCMR2_OC3M_FORCE_LOW;
+	TIM1_CCER = TIM_CCER_CC1E | TIM_CCER_CC2E | TIM_CCER_CC3E;
+	TIM1_EGR = TIM_EGR_COMG;
+#else
 #ifdef DRIVE_PWM
 	TIM1_PSC = DRIVE_PWM;
 	TIM1_ARR = 499;
@@ -219,6 +434,7 @@ void main(void) {
 	TIM1_CCMR2 = TIM_CCMR2_OC3PE | TIM_CCMR2_OC4PE | TIM_CCMR2_OC3M_PWM1;
 	TIM1_CCER = TIM_CCER_CC2E | TIM_CCER_CC3E;
 	TIM1_DIER = TIM_DIER_UIE | TIM_DIER_CC1IE | TIM_DIER_CC4IE;
+#endif
 
 	TIM3_PSC = 767; // 62.5kHz
 	TIM3_ARR = 20832; // 3Hz
@@ -248,16 +464,21 @@ void main(void) {
 	TIM17_CCMR1 = TIM_CCMR1_OC1M_FORCE_LOW;
 	TIM17_CCER = TIM_CCER_CC1E;
 
-	initsensor();
-	initserial();
 #ifdef DEBUG
 	printf("\n");
+#ifdef MONITOR
+	dumpmonitor(); // Before last reset
+#endif
 	printf("  U1   U2   U3      I1   I2   I3   I4   I5    SW\n");
 #endif
 	for (;;) {
 		SCB_SCR = SCB_SCR_SLEEPONEXIT; // Suspend main loop
 		__WFI();
 #ifdef DEBUG
+		if (boot1 > 0) {
+			printf("Boot: %dus since main() (PLL: %dus)\n", boot1, boot0);
+			boot1 = -1;
+		}
 		printf("%4d %4d %4d    %4d %4d %4d %4d %4d    %d %d\n",
 			u1, u2, u3, i1, i2, i3, i4, i5, s1, s2);
 #endif
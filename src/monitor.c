@@ -0,0 +1,117 @@
+/*
+** Copyright (C) Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** This firmware is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This firmware is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this firmware. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#ifdef MONITOR
+
+// Free RAM between the end of BSS and the stack is painted at startup. The high-watermark is found
+// by scanning up from the heap break (the heap is used by printf() in DEBUG mode). HardFault and
+// WWDG early wakeup save the exception frame of the interrupted code into a record at the top of
+// RAM (see common.ld) which survives reset.
+
+#define PAINT 0x5a5a5a5a
+#define MAGIC 0x4d4f4e49 // 'MONI'
+
+extern int end;
+
+void *_sbrk(int incr); // See libnosys
+
+static struct {
+	int magic;
+	int fresh; // Saved before last reset
+	int cause; // 1 - HardFault, 2 - watchdog, 3 - watchdog (no context)
+	int isr; // Active exception number (0 - main loop)
+	int pc, lr, psr;
+	int stack; // Free stack (bytes)
+} rec __attribute__((section(".noinit")));
+
+static int last; // Free stack before last reset
+
+static int stackfree(void) {
+	int *p = (int *)(((int)_sbrk(0) + 3) & ~3), *q = p;
+	while (*q == PAINT) ++q;
+	return rec.stack = (q - p) << 2;
+}
+
+void initmonitor(void) {
+	int csr = RCC_CSR;
+	RCC_CSR = RCC_CSR_RMVF;
+	if (rec.magic != MAGIC || (csr & RCC_CSR_PORRSTF)) { // Power on
+		rec.magic = MAGIC;
+		rec.cause = rec.isr = rec.pc = rec.lr = rec.psr = rec.stack = 0;
+	} else if (!rec.fresh && (csr & RCC_CSR_WWDGRSTF)) { // Stuck where early wakeup can't preempt
+		rec.cause = 3;
+		rec.isr = rec.pc = rec.lr = rec.psr = 0;
+	}
+	rec.fresh = 0;
+	last = rec.stack;
+	for (int *p = &end, *q = (int *)__builtin_frame_address(0) - 16; p < q; ++p) *p = PAINT;
+	WWDG_CFR |= WWDG_CFR_EWI;
+	nvic_enable_irq(NVIC_WWDG_IRQ);
+}
+
+int monitor(int c) {
+	switch (c) {
+		case 1: // Free stack
+			return stackfree();
+		case 2: // Last fault
+			return rec.cause * 100 + rec.isr;
+	}
+	return 0;
+}
+
+#ifdef DEBUG
+void dumpmonitor(void) {
+	printf("Stack: %d bytes free\n", last);
+	if (rec.cause) printf("Fault: cause %d, ISR %d, PC 0x%08x, LR 0x%08x, xPSR 0x%08x\n", rec.cause, rec.isr, rec.pc, rec.lr, rec.psr);
+}
+#endif
+
+void fault(const int *sp, int cause);
+void fault(const int *sp, int cause) {
+	int ok = (unsigned)sp - 0x20000000 <= 0x1000 - 64; // Stacked R0-R3, R12, LR, PC, xPSR
+	if (cause != 2 || !ok || (sp[7] & 0x3f)) { // Watchdog in idle main loop means lost link
+		rec.cause = cause;
+		if (ok) {
+			rec.lr = sp[5];
+			rec.pc = sp[6];
+			rec.psr = sp[7];
+			rec.isr = sp[7] & 0x3f;
+		} else rec.isr = rec.pc = rec.lr = rec.psr = 0; // Stack pointer out of RAM
+	}
+	stackfree();
+	rec.fresh = 1;
+	if (cause == 1) scb_reset_system();
+	for (;;); // Wait for watchdog reset
+}
+
+__attribute__((naked)) void hard_fault_handler(void) {
+	__asm__("mrs r0, msp\n"
+		"movs r1, #1\n"
+		"ldr r2, =fault\n"
+		"bx r2\n");
+}
+
+__attribute__((naked)) void wwdg_isr(void) {
+	__asm__("mrs r0, msp\n"
+		"movs r1, #2\n"
+		"ldr r2, =fault\n"
+		"bx r2\n");
+}
+
+#endif
@@ -17,27 +17,101 @@
 
 #include "common.h"
 
+// The ADC continuously scans all sensor channels into RAM by circular DMA.
+// The current channel is watched by the analog watchdog which folds back the outputs
+// within a single conversion. The watchdog is re-armed once the current has fallen below
+// the re-arm threshold (the window can't be changed on the fly while converting), after which
+// the outputs recover gradually at each update.
+
+int peak, trips;
+
+static volatile short adc[19];
+static int fold = 256, lo, min, tripped = 1;
+
+static int rank(int c) { // Position of channel in scan sequence
+	int n = 0;
+	for (int m = ADC1_CHSELR & ((1 << c) - 1); m; m &= m - 1) ++n;
+	return n;
+}
+
+void initcurrent(int ch, int ht, int lt, int x) {
+	nvic_set_priority(NVIC_ADC_COMP_IRQ, 0x40); // Same as USART1 so as not to preempt update()
+	nvic_enable_irq(NVIC_ADC_COMP_IRQ);
+	ADC1_CHSELR = 1 << ch;
+	ADC1_CFGR1 = ADC_CFGR1_AWDEN | ADC_CFGR1_AWDSGL | ch << 26; // AWDCH
+	ADC1_TR = ht << 16;
+	lo = lt;
+	min = x;
+}
+
 void initsensor(void) {
-	ADC1_CR = ADC_CR_ADCAL; // Start calibration
-	while (ADC1_CR & ADC_CR_ADCAL); // Calibration in progress
-	while (ADC1_CR = ADC_CR_ADEN, !(ADC1_ISR & ADC_ISR_ADRDY)); // Keep powering on until ready (Errata 2.5.3)
+	ADC1_CR = ADC_CR_ADCAL; // Start calibration (completes in background)
+}
+
+static int ready(void) { // Finish initialization once calibration is over
+	if (ADC1_CR & ADC_CR_ADSTART) return 1;
+	if (ADC1_CR & ADC_CR_ADCAL) return 0; // Calibration in progress
+	if (!(ADC1_ISR & ADC_ISR_ADRDY)) { // Keep powering on until ready (Errata 2.5.3)
+		ADC1_CR = ADC_CR_ADEN;
+		return 0;
+	}
 	ADC1_CCR = ADC_CCR_TSEN; // Enable temperature sensor
 	ADC1_SMPR = -1; // Maximum sampling time
+	for (int i = 0; i < 7; ++i) {
+		int q = sensors[i];
+		if (q && !(q & 0x800000)) ADC1_CHSELR |= 1 << (q >> 16);
+	}
+	if (!ADC1_CHSELR) return 0;
+	RCC_AHBENR |= RCC_AHBENR_DMAEN;
+	DMA1_CPAR1 = (int)&ADC1_DR;
+	DMA1_CMAR1 = (int)adc;
+	DMA1_CNDTR1 = rank(19);
+	DMA1_CCR1 = DMA_CCR_EN | DMA_CCR_CIRC | DMA_CCR_MINC | DMA_CCR_MSIZE_16BIT | DMA_CCR_PSIZE_16BIT;
+	ADC1_CFGR1 |= ADC_CFGR1_CONT | ADC_CFGR1_DMAEN | ADC_CFGR1_DMACFG;
+	ADC1_CR = ADC_CR_ADSTART; // Start continuous conversion
+	return 0;
 }
 
 int senstype(int i) {
-	return i < 3 ? sensors[i] & 0xffff : 0;
+	return i < 7 ? sensors[i] & 0xffff : 0;
 }
 
 int sensval(int i) {
-	static int s[3];
-	if (i >= 3) return 0;
+	static int s[7];
+	if (i >= 7) return 0;
 	int q = sensors[i];
 	if (!q) return 0;
-	ADC1_CHSELR = 1 << (q >> 16); // Set channel
-	ADC1_CR = ADC_CR_ADSTART; // Start conversion
-	while (!(ADC1_ISR & ADC_ISR_EOC)); // Conversion in progress
-	int x = ADC1_DR; // Clear EOC
+#ifdef MONITOR
+	if ((q & 0x800000) && (q & 0x7f0000)) return monitor(q >> 16 & 0x7f); // Monitor value
+#endif
+	if (q & 0x800000) return sensor(i, 0); // No channel
+	if (!ready()) return 0;
+	int x = adc[rank(q >> 16)];
 	if (!(q = s[i])) s[i] = q = x << 7;
 	return sensor(i, (s[i] = x + q - (q >> 7)) >> 7);
 }
+
+int foldback(int x) {
+	if (!ready()) return fold;
+	int v = adc[rank(ADC1_CFGR1 >> 26 & 0x1f)];
+	if (v > peak) peak = v;
+	if (tripped) {
+		if (v >= lo) return fold;
+		tripped = 0;
+		ADC1_ISR = ADC_ISR_AWD;
+		ADC1_IER = ADC_IER_AWDIE; // Re-arm watchdog
+	}
+	if ((fold += x) > 256) fold = 256;
+	return fold;
+}
+
+void adc_comp_isr(void) {
+	ADC1_IER = 0; // Disarm watchdog until current falls
+	ADC1_ISR = ADC_ISR_AWD;
+	int v = adc[rank(ADC1_CFGR1 >> 26 & 0x1f)];
+	if (v > peak) peak = v;
+	tripped = 1;
+	++trips;
+	if ((fold >>= 1) < min) fold = min;
+	trip(fold);
+}
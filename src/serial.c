@@ -37,6 +37,13 @@ void initserial(void) {
 	TIM16_DIER = TIM_DIER_UIE;
 }
 
+#ifdef BOOTLOADER
+static void boot(void) { // Reset into bootloader
+	BOOT_FLAG = BOOT_MAGIC;
+	scb_reset_system();
+}
+#endif
+
 #ifdef DEBUG
 int _write(int fd, const char *buf, int len);
 int _write(int fd, const char *buf, int len) { // STDOUT -> USART1_TX (blocking)
@@ -107,6 +114,10 @@ void usart1_isr(void) {
 	static int u, m, n = 30;
 	a = b;
 	b = USART1_RDR; // Clear RXNE
+#ifdef BOOTLOADER
+	static int w, h;
+	if ((w = w << 8 | (b & 0xff)) == BOOT_MAGIC) boot(); // Magic sequence received
+#endif
 	if (USART1_CR3 & USART_CR3_HDSEL) { // iBUS sens
 		if (m == 4 || ++m & 1) return;
 		if (m == 4) { // End of chunk
@@ -161,6 +172,10 @@ void usart1_isr(void) {
 		int v = a | b << 8;
 		if (n == 30) { // End of chunk
 			if (u != v) return; // Sync lost
+#ifdef BOOTLOADER
+			if (chv[9] < 1900) h = 0;
+			else if (++h == 400) boot(); // Channel 10 held high for ~3s
+#endif
 			update();
 #ifndef DEBUG
 			m = 0;
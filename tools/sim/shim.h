@@ -0,0 +1,136 @@
+/*
+** Copyright (C) Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** This firmware is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This firmware is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this firmware. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+// Registers are plain variables, GPIO BSRR writes are logged and applied after update().
+// Timer burst DMA is emulated at the update event of TIM1 (see sim.c).
+
+#define REGS \
+	R(RCC_AHBENR) R(RCC_APB1ENR) R(RCC_APB2ENR) \
+	R(GPIOA_AFRL) R(GPIOA_AFRH) R(GPIOA_ODR) R(GPIOA_PUPDR) R(GPIOA_MODER) \
+	R(GPIOB_AFRL) R(GPIOB_MODER) R(GPIOF_MODER) \
+	R(TIM1_CR1) R(TIM1_CR2) R(TIM1_DIER) R(TIM1_SR) R(TIM1_EGR) R(TIM1_CCMR1) R(TIM1_CCMR2) R(TIM1_CCER) \
+	R(TIM1_CNT) R(TIM1_PSC) R(TIM1_ARR) R(TIM1_RCR) R(TIM1_CCR1) R(TIM1_CCR2) R(TIM1_CCR3) R(TIM1_CCR4) R(TIM1_BDTR) R(TIM1_DCR) R(TIM1_DMAR) \
+	R(TIM3_CR1) R(TIM3_SMCR) R(TIM3_DIER) R(TIM3_SR) R(TIM3_EGR) R(TIM3_CCMR1) R(TIM3_CCMR2) R(TIM3_CCER) \
+	R(TIM3_PSC) R(TIM3_ARR) R(TIM3_CCR1) R(TIM3_CCR2) R(TIM3_CCR3) R(TIM3_CCR4) R(TIM3_DCR) R(TIM3_DMAR) \
+	R(TIM14_CR1) R(TIM14_EGR) R(TIM14_CCMR1) R(TIM14_CCER) R(TIM14_PSC) R(TIM14_ARR) R(TIM14_CCR1) \
+	R(TIM17_CR1) R(TIM17_EGR) R(TIM17_CCMR1) R(TIM17_CCER) R(TIM17_ARR) R(TIM17_CCR1) R(TIM17_BDTR) \
+	R(DMA1_CCR4) R(DMA1_CNDTR4) R(DMA1_CPAR4) R(DMA1_CMAR4) R(DMA1_CCR5) R(DMA1_CNDTR5) R(DMA1_CPAR5) R(DMA1_CMAR5) \
+	R(WWDG_CR) R(WWDG_CFR) R(SCB_SCR) R(STK_CSR) R(STK_RVR) R(STK_CVR)
+
+#define R(x) extern volatile unsigned x;
+REGS
+#undef R
+
+#define GPIOA_BSRR (*bsrr(0))
+#define GPIOF_BSRR (*bsrr(5))
+
+unsigned *bsrr(int port);
+
+#define RCC_AHBENR_DMAEN (1 << 0)
+#define RCC_AHBENR_GPIOAEN (1 << 17)
+#define RCC_AHBENR_GPIOBEN (1 << 18)
+#define RCC_AHBENR_GPIOFEN (1 << 22)
+#define RCC_APB1ENR_TIM3EN (1 << 1)
+#define RCC_APB1ENR_TIM14EN (1 << 8)
+#define RCC_APB1ENR_WWDGEN (1 << 11)
+#define RCC_APB2ENR_SYSCFGCOMPEN (1 << 0)
+#define RCC_APB2ENR_ADCEN (1 << 9)
+#define RCC_APB2ENR_TIM1EN (1 << 11)
+#define RCC_APB2ENR_USART1EN (1 << 14)
+#define RCC_APB2ENR_TIM16EN (1 << 17)
+#define RCC_APB2ENR_TIM17EN (1 << 18)
+
+#define TIM_CR1_CEN (1 << 0)
+#define TIM_CR1_UDIS (1 << 1)
+#define TIM_CR1_CMS_CENTER_1 (1 << 5)
+#define TIM_CR2_CCPC (1 << 0)
+#define TIM_CR2_MMS_UPDATE (2 << 4)
+#define TIM_SMCR_SMS_TM (6 << 0)
+#define TIM_SMCR_TS_ITR0 (0 << 4)
+#define TIM_DIER_UIE (1 << 0)
+#define TIM_DIER_CC1IE (1 << 1)
+#define TIM_DIER_CC4IE (1 << 4)
+#define TIM_DIER_UDE (1 << 8)
+#define TIM_DIER_TDE (1 << 14)
+#define TIM_SR_UIF (1 << 0)
+#define TIM_SR_CC1IF (1 << 1)
+#define TIM_SR_CC4IF (1 << 4)
+#define TIM_EGR_UG (1 << 0)
+#define TIM_EGR_COMG (1 << 5)
+#define TIM_CCMR1_OC1PE (1 << 3)
+#define TIM_CCMR1_OC1M_TOGGLE (3 << 4)
+#define TIM_CCMR1_OC1M_FORCE_LOW (4 << 4)
+#define TIM_CCMR1_OC1M_PWM1 (6 << 4)
+#define TIM_CCMR1_OC1M_PWM2 (7 << 4)
+#define TIM_CCMR1_OC2PE (1 << 11)
+#define TIM_CCMR1_OC2M_FORCE_LOW (4 << 12)
+#define TIM_CCMR1_OC2M_PWM1 (6 << 12)
+#define TIM_CCMR1_OC2M_PWM2 (7 << 12)
+#define TIM_CCMR2_OC3PE (1 << 3)
+#define TIM_CCMR2_OC3M_FORCE_LOW (4 << 4)
+#define TIM_CCMR2_OC3M_PWM1 (6 << 4)
+#define TIM_CCMR2_OC3M_PWM2 (7 << 4)
+#define TIM_CCMR2_OC4PE (1 << 11)
+#define TIM_CCMR2_OC4M_TOGGLE (3 << 12)
+#define TIM_CCMR2_OC4M_FORCE_LOW (4 << 12)
+#define TIM_CCMR2_OC4M_PWM1 (6 << 12)
+#define TIM_CCER_CC1E (1 << 0)
+#define TIM_CCER_CC1P (1 << 1)
+#define TIM_CCER_CC1NE (1 << 2)
+#define TIM_CCER_CC2E (1 << 4)
+#define TIM_CCER_CC3E (1 << 8)
+#define TIM_CCER_CC3NE (1 << 10)
+#define TIM_CCER_CC4E (1 << 12)
+#define TIM_CCER_CC4P (1 << 13)
+#define TIM_BDTR_OSSR (1 << 11)
+#define TIM_BDTR_MOE (1 << 15)
+
+#define DMA_CCR_EN (1 << 0)
+#define DMA_CCR_DIR (1 << 4)
+#define DMA_CCR_CIRC (1 << 5)
+#define DMA_CCR_MINC (1 << 7)
+#define DMA_CCR_PSIZE_16BIT (1 << 8)
+#define DMA_CCR_MSIZE_16BIT (1 << 10)
+
+#define SCB_SCR_SLEEPONEXIT (1 << 1)
+#define STK_CSR_ENABLE (1 << 0)
+
+#define ST_TSENSE_CAL1_30C 1750
+#define ST_TSENSE_CAL2_110C 1330
+
+#define MMIO32(x) (*(volatile unsigned *)(x))
+
+enum {
+	NVIC_TIM1_BRK_UP_TRG_COM_IRQ,
+	NVIC_TIM1_CC_IRQ,
+	NVIC_TIM3_IRQ,
+};
+
+void nvic_enable_irq(int irq);
+void rcc_clock_setup_in_hsi_out_48mhz(void);
+void __WFI(void);
+
+// Tuning parameters
+struct params {
+#define P(n, v) int n;
+#include "params.h"
+#undef P
+};
+
+extern struct params par;
@@ -0,0 +1,395 @@
+/*
+** Copyright (C) Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** This firmware is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This firmware is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this firmware. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+
+// Closed-loop simulation of the real update() against a register shim.
+// Valve servos, pump and tracks are modeled as simple dynamic systems driven by the outputs.
+
+#define FRAME 7 // iBUS frame period (ms)
+#define DT 4 // Plant time step (ms)
+#define SETTLE 3 // Neutral frames before profile
+#define TAIL 1000 // Run time after last event (ms)
+#define MAXT 60000 // Maximum run time (ms)
+#define MAXE 256 // Maximum number of events
+
+#define SERVO_RATE 3.0 // Valve servo slew rate (us/ms)
+#define PUMP_TAU 80.0 // Pump spin-up time constant (ms)
+#define BYPASS 0.05 // Flow through closed valves (relief)
+#define TRACK_W 0.0157 // Track natural frequency (rad/ms)
+#define TRACK_Z 0.45 // Track damping ratio
+#define STEP_MIN 0.02 // Smallest step taken into account
+
+#ifdef SIM_JDM
+#define SPOOL_MIN 200 // Spool overlap (us)
+#define SPOOL_MAX 300 // Spool fully open (us)
+#define VALVE1 ((int)TIM3_CCR1 - def.CH1_TRIM) // Firmware drives valve servos
+#define VALVE2 ((int)TIM3_CCR2 - def.CH2_TRIM)
+#define VALVE3 ((int)TIM3_CCR4 - def.CH5_TRIM)
+#else
+#define SPOOL_MIN 80
+#define SPOOL_MAX 200
+#define VALVE1 chv[0] // Receiver drives valve servos
+#define VALVE2 chv[1]
+#define VALVE3 chv[4]
+#endif
+
+#define R(x) volatile unsigned x;
+REGS
+#undef R
+
+struct params par = {
+#define P(n, v) v,
+#include "params.h"
+#undef P
+};
+
+static const struct params def = {
+#define P(n, v) v,
+#include "params.h"
+#undef P
+};
+
+static const char *names[] = {
+#define P(n, v) #n,
+#include "params.h"
+#undef P
+};
+
+#define NPAR (int)(sizeof names / sizeof *names)
+
+int chv[14], peak, trips;
+
+static jmp_buf init;
+
+void fw_main(void);
+void tim1_brk_up_trg_com_isr(void) __attribute__((weak));
+
+void initserial(void) {}
+void initsensor(void) {}
+void initcurrent(int ch, int ht, int lt, int min) {}
+void initmonitor(void) {}
+int foldback(int x) {return 256;}
+void nvic_enable_irq(int irq) {}
+void rcc_clock_setup_in_hsi_out_48mhz(void) {}
+void __WFI(void) {longjmp(init, 1);} // Main loop reached
+
+static unsigned odr[6];
+static struct {
+	int port;
+	unsigned val;
+} wr[32];
+static int nwr;
+
+static void flush(void) {
+	for (int i = 0; i < nwr; ++i) {
+		int p = wr[i].port;
+		odr[p] = (odr[p] & ~(wr[i].val >> 16)) | (wr[i].val & 0xffff);
+	}
+	nwr = 0;
+}
+
+unsigned *bsrr(int port) {
+	if (nwr == 32) flush();
+	wr[nwr].port = port;
+	return &wr[nwr++].val;
+}
+
+static void burst(volatile unsigned *const *reg, unsigned dcr, unsigned ccr, unsigned mar, unsigned ndtr) {
+	if (!(ccr & DMA_CCR_EN) || (dcr & 0x1f) != 13) return; // CCR1 onwards only
+	short *p = (short *)(uintptr_t)mar;
+	for (unsigned i = 0; i <= (dcr >> 8 & 0x1f) && i < ndtr && i < 4; ++i) *reg[i] = p[i];
+}
+
+static void tim1(void) { // TIM1 update event
+	static volatile unsigned *const r1[] = {&TIM1_CCR1, &TIM1_CCR2, &TIM1_CCR3, &TIM1_CCR4};
+	static volatile unsigned *const r3[] = {&TIM3_CCR1, &TIM3_CCR2, &TIM3_CCR3, &TIM3_CCR4};
+	if (TIM1_DIER & TIM_DIER_UDE) burst(r1, TIM1_DCR, DMA1_CCR5, DMA1_CMAR5, DMA1_CNDTR5);
+	if (TIM3_DIER & TIM_DIER_TDE) burst(r3, TIM3_DCR, DMA1_CCR4, DMA1_CMAR4, DMA1_CNDTR4); // Slave trigger
+	if ((TIM1_DIER & TIM_DIER_UIE) && tim1_brk_up_trg_com_isr) tim1_brk_up_trg_com_isr();
+}
+
+static struct {
+	int t, ch, val, d;
+} ev[MAXE] = { // Default profile: bucket, lift arm, ripper, forward, spin, reverse, slow lift arm
+	{500, 1, 2000}, {2000, 1, 1500},
+	{2500, 2, 1000}, {4000, 2, 1500},
+	{4500, 5, 2000}, {6000, 5, 1500},
+	{6500, 3, 2000}, {8500, 3, 1500},
+	{9500, 4, 2000}, {11000, 4, 1500},
+	{12000, 3, 1000}, {14000, 3, 1500},
+	{15000, 2, 1000, 2000}, {18000, 2, 1500, 1000},
+};
+static int nev = 14;
+
+static float sig[4][MAXT / DT]; // Valve 1-3 cylinder speed, left track speed (per plant step)
+static int trace;
+
+struct result {
+	double t1, t2, o2, waste;
+};
+
+static double opening(double x) {
+	double a = x < 0 ? -x : x;
+	if (a <= SPOOL_MIN) return 0;
+	a = a >= SPOOL_MAX ? 1 : (a - SPOOL_MIN) / (SPOOL_MAX - SPOOL_MIN);
+	return x < 0 ? -a : a;
+}
+
+static double duty(int t) { // Servo pulse to ESC duty
+	double x = (t - 1500) / 500.0;
+	return x < -1 ? -1 : x > 1 ? 1 : x;
+}
+
+#ifdef SIM_DRIVE_BRIDGE
+static int shoot; // Both switches of a leg on
+
+static void gates(int ch, double *h, double *l) { // Leg A on-time of OCx and OCxN (center-aligned, OSSR=1)
+	int m = (ch == 2 ? TIM1_CCMR1 >> 12 : ch == 3 ? TIM1_CCMR2 >> 4 : TIM1_CCMR1 >> 4) & 7;
+	int e = TIM1_CCER >> ((ch - 1) << 2);
+	double x = (ch == 2 ? TIM1_CCR2 : ch == 3 ? TIM1_CCR3 : TIM1_CCR1) / (double)TIM1_ARR, r = 0;
+	if (x > 1) x = 1;
+	if (m == 5) r = 1; // Force high
+	else if (m == 6) r = x; // PWM1
+	else if (m == 7) r = 1 - x; // PWM2
+	*h = e & 1 ? r : 0;
+	*l = e & 4 ? e & 1 ? 1 - r : r : 0; // OCxN follows OCxREF when OCx is off
+}
+
+static double leg(double ha, double la, int hb, int lb) { // Bridge voltage
+	if (ha + la > 1.0001 || (hb && lb)) shoot = 1;
+	return ha * lb - la * hb;
+}
+#endif
+
+static void drive(double *l, double *r) {
+#ifdef SIM_DRIVE_BRIDGE
+	double h1, l1, h2, l2, x;
+	gates(2, &h1, &x); // Left leg A high side: CH2
+	gates(1, &x, &l1); // Left leg A low side: CH1N
+	gates(3, &h2, &l2); // Right leg A: CH3, CH3N
+	*l = leg(h1, l1, (odr[0] >> 5) & 1, (odr[0] >> 1) & 1); // Leg B: A5 high side, A1 low side
+	*r = leg(h2, l2, (odr[5] >> 1) & 1, odr[5] & 1); // Leg B: F1 high side, F0 low side
+#elif defined SIM_DRIVE_PWM
+	*l = TIM1_CCR2 / 500.0 * ((int)(odr[0] >> 1 & 1) - (int)(odr[0] >> 5 & 1)); // A1,A5
+	*r = TIM1_CCR3 / 500.0 * ((int)(odr[5] & 1) - (int)(odr[5] >> 1 & 1)); // F0,F1
+#else
+	*l = duty(TIM1_CCR2);
+	*r = duty(TIM1_CCR3);
+#endif
+}
+
+static void run(struct result *res) {
+	double sv[3] = {0}, pw = 0, x[2] = {0}, xd[2] = {0}, waste = 0;
+	int end = ev[nev - 1].t + ev[nev - 1].d + TAIL, e = 0;
+	int per = (TIM1_PSC + 1) * (TIM1_ARR + 1) / 48000; // TIM1 period (ms)
+	int rt[14], r0[14], r1[14], rd[14] = {0}; // Stick ramps
+	for (int i = 0; i < 14; ++i) chv[i] = i < 5 ? 1500 : 1000;
+	memset(odr, 0, sizeof odr);
+	for (int i = 0; i < SETTLE; ++i) {
+		update();
+		flush();
+	}
+	for (int t = 0; t < end; ++t) {
+		while (e < nev && ev[e].t <= t) {
+			int i = ev[e].ch - 1;
+			rt[i] = t;
+			r0[i] = chv[i];
+			r1[i] = ev[e].val;
+			rd[i] = ev[e].d;
+			if (!rd[i]) chv[i] = r1[i];
+			++e;
+		}
+		if (!(t % FRAME)) {
+			for (int i = 0; i < 14; ++i) { // Sticks are only sampled by update()
+				if (!rd[i]) continue;
+				int x = t - rt[i];
+				if (x < rd[i]) chv[i] = r0[i] + (r1[i] - r0[i]) * x / rd[i];
+				else {
+					chv[i] = r1[i];
+					rd[i] = 0;
+				}
+			}
+			update();
+			flush();
+		}
+		if (!per || !(t % per)) {
+			tim1();
+			flush();
+		}
+		if (t % DT != DT - 1) continue;
+		int vp[3] = {VALVE1 - 1500, VALVE2 - 1500, VALVE3 - 1500}, k = t / DT;
+		double o[3], s = BYPASS;
+		for (int i = 0; i < 3; ++i) {
+			double d = vp[i] - sv[i], m = SERVO_RATE * DT;
+			sv[i] += d > m ? m : d < -m ? -m : d;
+			o[i] = opening(sv[i]);
+			s += o[i] < 0 ? -o[i] : o[i];
+		}
+		double p = duty(TIM14_CCR1);
+		if (p < 0) p = 0;
+		if (s == BYPASS) waste += p * DT / 1000;
+		pw += (p - pw) * DT / PUMP_TAU;
+		for (int i = 0; i < 3; ++i) sig[i][k] = pw * o[i] / s;
+		double c[2];
+		drive(c, c + 1);
+		for (int i = 0; i < 2; ++i) {
+			xd[i] += (TRACK_W * TRACK_W * (c[i] - x[i]) - 2 * TRACK_Z * TRACK_W * xd[i]) * DT;
+			x[i] += xd[i] * DT;
+		}
+		sig[3][k] = x[0];
+#ifdef SIM_DRIVE_BRIDGE
+		if (shoot) {
+			fprintf(stderr, "Shoot-through at %dms\n", t);
+			exit(1);
+		}
+#endif
+		if (trace) printf("%d %4d %4d %4d %4d %4d %4d %.3f %.3f %.3f %.3f %.3f %.3f\n",
+			t, vp[0], vp[1], vp[2], TIM14_CCR1, (int)TIM1_CCR2, (int)TIM1_CCR3, sig[0][k], sig[1][k], sig[2][k], pw, x[0], x[1]);
+	}
+	int n1 = 0, n2 = 0, last[14];
+	memset(res, 0, sizeof *res);
+	res->waste = waste;
+	for (int i = 0; i < 14; ++i) last[i] = i < 5 ? 1500 : 1000;
+	for (int i = 0; i < nev; ++i) {
+		int k = ev[i].ch == 3 || ev[i].ch == 4 ? 3 : ev[i].ch == 5 ? 2 : ev[i].ch - 1, v = last[ev[i].ch - 1];
+		last[ev[i].ch - 1] = ev[i].val;
+		if (k > 3) continue;
+		if (k == 3 && abs(ev[i].val - 1500) < abs(v - 1500)) continue; // Deceleration is not ramped
+		int t0 = ev[i].t, t1 = end, j = i;
+		while (++j < nev) {
+			if (ev[j].t > t0) {
+				t1 = ev[j].t;
+				break;
+			}
+		}
+		int k0 = t0 / DT, k1 = t1 / DT; // Plant steps
+		double y0 = sig[k][k0], d = sig[k][k1 - 1] - y0, o = 0;
+		if (d > -STEP_MIN && d < STEP_MIN) continue;
+		int tr = t1 - t0;
+		for (int m = k1 - 1; m >= k0; --m) {
+			double y = (sig[k][m] - y0) / d;
+			if (y >= 0.9) tr = (m + 1) * DT - t0;
+			if (y - 1 > o) o = y - 1;
+		}
+		if (k < 3) { // Cylinder speed can't overshoot (no pressure dynamics)
+			res->t1 += tr;
+			++n1;
+		} else {
+			res->t2 += tr;
+			if (o > res->o2) res->o2 = o;
+			++n2;
+		}
+	}
+	if (n1) res->t1 /= n1;
+	if (n2) res->t2 /= n2;
+}
+
+static void load(const char *name) {
+	FILE *f = fopen(name, "r");
+	if (!f) {
+		perror(name);
+		exit(1);
+	}
+	char buf[256];
+	double t, d;
+	int ch, val;
+	nev = 0;
+	while (fgets(buf, sizeof buf, f)) {
+		int k = sscanf(buf, "%lf %d %d %lf", &t, &ch, &val, &d);
+		if (*buf == '#' || k < 3) continue;
+		if (nev == MAXE || ch < 1 || ch > 14 || (nev && t * 1000 < ev[nev - 1].t)) {
+			fprintf(stderr, "%s: invalid event '%s'\n", name, buf);
+			exit(1);
+		}
+		ev[nev].t = t * 1000;
+		ev[nev].ch = ch;
+		ev[nev].val = val;
+		ev[nev].d = k > 3 ? d * 1000 : 0;
+		++nev;
+	}
+	fclose(f);
+	if (!nev || ev[nev - 1].t + ev[nev - 1].d + TAIL > MAXT) {
+		fprintf(stderr, "%s: invalid profile\n", name);
+		exit(1);
+	}
+}
+
+static int find(const char *name, int len) {
+	for (int i = 0; i < NPAR; ++i) {
+		if (!strncmp(names[i], name, len) && !names[i][len]) return i;
+	}
+	return -1;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-p profile] [-t] [NAME=value|NAME=min:max[:step]]...\n", name);
+	fprintf(stderr, "Parameters:");
+	for (int i = 0; i < NPAR; ++i) fprintf(stderr, " %s=%d", names[i], ((const int *)&def)[i]);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	TIM1_CNT = 1000; // Outputs are staged mid-period, clear of the update event
+	if (!setjmp(init)) fw_main(); // Initialize peripherals
+	flush();
+	int idx[NPAR], min[NPAR], max[NPAR], step[NPAR], n = 0;
+	for (int i = 1; i < argc; ++i) {
+		char *a = argv[i], *p;
+		if (!strcmp(a, "-t")) trace = 1;
+		else if (!strcmp(a, "-p") && i + 1 < argc) load(argv[++i]);
+		else if ((p = strchr(a, '=')) && (idx[n] = find(a, p - a)) >= 0) {
+			int k = sscanf(p + 1, "%d:%d:%d", min + n, max + n, step + n);
+			if (k < 1) usage(*argv);
+			if (k < 2) max[n] = min[n];
+			if (k < 3) step[n] = 1;
+			if (step[n] < 1 || max[n] < min[n]) usage(*argv);
+			((int *)&par)[idx[n]] = min[n];
+			++n;
+		} else usage(*argv);
+	}
+	printf("# valve(ms) drive(ms) ovs(%%) waste(s)");
+	for (int i = 0; i < n; ++i) printf(" %s", names[idx[i]]);
+	printf("\n");
+	long runs = 0;
+	clock_t c = clock();
+	for (;;) {
+		struct result r;
+		run(&r);
+		++runs;
+		printf("%9.1f %9.1f %7.1f %8.3f", r.t1, r.t2, r.o2 * 100, r.waste);
+		for (int i = 0; i < n; ++i) printf(" %d", ((int *)&par)[idx[i]]);
+		printf("\n");
+		int i = n;
+		while (i--) { // Next combination
+			int *v = (int *)&par + idx[i];
+			if ((*v += step[i]) <= max[i]) break;
+			*v = min[i];
+		}
+		if (i < 0) break;
+	}
+	double s = (double)(clock() - c) / CLOCKS_PER_SEC;
+	fprintf(stderr, "%ld runs in %.2fs (%.0f runs/s)\n", runs, s, runs / (s > 0 ? s : 1e-9));
+	return 0;
+}
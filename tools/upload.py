@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) Arseny Vakhrushev <arseny.vakhrushev@me.com>
+#
+# This firmware is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This firmware is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this firmware. If not, see <http://www.gnu.org/licenses/>.
+#
+
+# Firmware uploader for the serial bootloader (see src/boot.c)
+# Usage: upload.py <device> <firmware.bin>
+
+import struct
+import sys
+import time
+
+import serial
+
+PAGE = 1024
+APP = 0x08000800  # Application start (see src/app.ld)
+END = 0x08004000  # Flash end
+
+
+def crc(data):  # STM32 hardware CRC unit
+	x = 0xffffffff
+	for (w,) in struct.iter_unpack('<I', data):
+		x ^= w
+		for _ in range(32):
+			x = (x << 1 ^ 0x04c11db7 if x & 0x80000000 else x << 1) & 0xffffffff
+	return x
+
+
+def read(port, n):
+	data = port.read(n)
+	if len(data) != n:
+		sys.exit('Bootloader not responding')
+	return data
+
+
+def connect(port):  # Returns CRC of application pages
+	port.timeout = 0.05
+	t = time.time()
+	hint = True
+	while time.time() - t < 30:
+		port.reset_input_buffer()
+		port.write(b'BOOTC')  # Stay in bootloader if it listens after reset, then query
+		data = port.read(1)
+		if data:
+			port.timeout = 1
+			return struct.unpack('<%dI' % data[0], read(port, data[0] * 4))
+		if hint and time.time() - t > 1:
+			print('Waiting for bootloader (reset the board)')
+			hint = False
+	sys.exit('Bootloader not responding')
+
+
+def main():
+	if len(sys.argv) != 3:
+		sys.exit('Usage: %s <device> <firmware.bin>' % sys.argv[0])
+	with open(sys.argv[2], 'rb') as f:
+		image = f.read()
+	image += b'\xff' * (-len(image) % PAGE)
+	sp, pc = struct.unpack('<2I', image[:8])
+	if not 0x20000000 <= sp <= 0x20001000 or not APP <= pc < END:  # Stack pointer and reset vector
+		sys.exit('Invalid image (not built with ENABLE_BOOTLOADER?)')
+
+	port = serial.Serial(sys.argv[1], 115200, timeout=1)
+	port.write(b'BOOT')  # Reset running firmware into bootloader
+	port.flush()
+	time.sleep(0.1)
+	port.baudrate = 500000
+	port.reset_input_buffer()
+
+	sums = connect(port)
+	n = len(sums)
+	if len(image) > n * PAGE:
+		sys.exit('Image too large')
+	pages = [i for i in range(len(image) // PAGE) if crc(image[i * PAGE:(i + 1) * PAGE]) != sums[i]]
+	if pages and pages[0] == 0:
+		pages = pages[1:]
+	if pages or sums[0] != crc(image[:PAGE]):
+		pages.append(0)  # Vector table goes last
+
+	t = time.time()
+	for i in pages:
+		data = image[i * PAGE:(i + 1) * PAGE]
+		port.write(b'W' + bytes([i]) + data + struct.pack('<I', crc(data)))
+		if read(port, 1) != b'K':
+			sys.exit('Failed to write page %d' % i)
+		print('Page %d written' % i)
+	port.write(b'G')
+	print('%d of %d pages updated in %.1fs' % (len(pages), len(image) // PAGE, time.time() - t))
+
+
+if __name__ == '__main__':
+	main()